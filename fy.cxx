@@ -3,26 +3,39 @@
 #include "fy.h"
 #include "vendor/linenoise/linenoise.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
-#include <map>
+#include <algorithm>
 #include <string>
+#include <vector>
 
 #define FPF fprintf
 
 #ifdef OPT
 #define LOG if(false)fprintf
 #else
-#define LOG if(true)fprintf
+#define LOG if(TraceText)fprintf
 #endif
 
-using std::map;
 using std::string;
+using std::vector;
 
 const char *Argv0;
 bool QuitAfterSlurping;
 
-char Mem[MEMLEN];
+alignas(64) char Mem[MEMLEN];    // Aligned so mapped files are cell-aligned.
+
+Mapping Mappings[MaxMappings];
+int NumMappings;
 
 U Ds;                           // data stack ptr
 U Ds0;                          // data stack ptr base
@@ -34,31 +47,165 @@ U W;                            // W register
 U HerePtr;                      // points to Here variable
 U LatestPtr;                    // points to Latest variable
 U StatePtr;                     // points to State variable
+U StopThread;                   // a thread holding just `(stop)`
+U WordDelimiter;                // the char that ended the last word read
+
+// HERE, LATEST and NumTokens as `:` found them, to undo a definition
+// abandoned when a word runs out of execution budget.
+U ColonHere;
+U ColonLatest;
+int ColonTokens;
+
+#if TOKENS
+U TokenCfa[MAXTOKENS];          // token -> cfa, in increasing cfa order.
+#endif
+int NumTokens;
 
 int Debug;
 int MustOk;
+bool TraceText;                 // -t: verbose text tracing, in non-OPT builds.
+const char *TraceFilename = "fy.trace";
+
+// The execution budget bounds each evaluation, that is, each word the
+// outer interpreter executes.  It is counted in ticks:  each call of a
+// colon or DOES> word, and each backward branch, costs one tick.  The
+// budget is only checked there, so straight-line code runs unhindered.
+ULL BudgetTicks;                // -L<n>: ticks per evaluation, or 0.
+ULL BudgetMicros;               // -L<n>ms: time per evaluation, or 0.
+bool BudgetBlown;               // the last evaluation ran out of budget.
+const int BudgetPoll = 1024;    // ticks between looking at the clock.
+int64_t budget_ticks_left;      // ticks not yet handed to DispatchLoop.
+ULL budget_deadline;            // in NowMicros, or 0.
+
+// The word index is every word in the dictionary, sorted by address.
+// CreateWord does not touch it; UpdateIndex extends it lazily when
+// someone asks about addresses.
+struct IndexEntry {
+  U link;                       // address of the word's header
+  U cfa;
+  const char *Name() const {
+    return &Mem[link + S + 1];  // name follows link and length/flags byte.
+  }
+};
+vector < IndexEntry > word_index;
+
+// The name hash maps each name to the link of its newest word, for
+// LookupCfa.  It is open-addressed with a power-of-two size; 0 is empty.
+vector < U > name_hash;
+
+size_t NameHash(const char *s)
+{
+  size_t h = 2166136261u;       // FNV-1a, ignoring case.
+  for (; *s; s++) {
+    h = (h ^ (B) tolower(*s)) * 16777619u;
+  }
+  return h;
+}
 
-map < U, string > link_map, cfa_map, dfa_map;   // Just for debugging.
+void HashInsert(U link)
+{
+  size_t mask = name_hash.size() - 1;
+  const char *name = &Mem[link + S + 1];
+  size_t k = NameHash(name) & mask;
+  while (name_hash[k] && !strcaseeq(name, &Mem[name_hash[k] + S + 1])) {
+    k = (k + 1) & mask;
+  }
+  name_hash[k] = link;          // Newer words replace older ones.
+}
+
+U CfaOfLink(U link)
+{
+  // code addr follows name and '\0' and alignment.
+  return Aligned(link + S + 1 + strlen(&Mem[link + S + 1]) + 1);
+}
+
+void UpdateIndex()
+{
+  U latest = Get(LatestPtr);
+  U last = word_index.empty()? 0 : word_index.back().link;
+  if (latest == last)
+    return;
+  // Append words newer than the last indexed one, newest first,
+  // then put them in address order.
+  size_t old = word_index.size();
+  U ptr = latest;
+  for (; ptr && ptr > last; ptr = Get(ptr)) {
+    word_index.push_back({ptr, CfaOfLink(ptr)});
+  }
+  if (ptr != last) {
+    // The dictionary changed under us; index it all again.
+    word_index.clear();
+    name_hash.clear();
+    old = 0;
+    for (ptr = latest; ptr; ptr = Get(ptr)) {
+      word_index.push_back({ptr, CfaOfLink(ptr)});
+    }
+  }
+  std::reverse(word_index.begin() + old, word_index.end());
+
+  if (name_hash.size() < 2 * word_index.size()) {
+    size_t n = 64;
+    while (n < 4 * word_index.size())
+      n *= 2;
+    name_hash.assign(n, 0);
+    old = 0;
+  }
+  for (size_t k = old; k < word_index.size(); k++) {
+    HashInsert(word_index[k].link);
+  }
+}
+
+// FindWord returns the index entry of the word containing addr,
+// or nullptr if addr is not in the dictionary.
+const IndexEntry *FindWord(U addr)
+{
+  UpdateIndex();
+  if (addr >= Get(HerePtr))
+    return nullptr;
+  auto it = std::upper_bound(word_index.begin(), word_index.end(), addr,[](U a, const IndexEntry & e) {
+                             return a < e.link;
+                             });
+  if (it == word_index.begin())
+    return nullptr;
+  return &*(it - 1);
+}
+
+// EndOfWord is where the next word (or HERE) begins.
+U EndOfWord(const IndexEntry * e)
+{
+  if (e + 1 < word_index.data() + word_index.size())
+    return (e + 1)->link;
+  return Get(HerePtr);
+}
 
 InputKey input_key;
+TraceRing trace_ring;
+Profiler profiler;
+Stats stats;
+
+const char *opcode_enum_names[] = {
+#include "generated-enum-names.inc"
+};
+constexpr U NumOpcodes = sizeof(opcode_enum_names) / sizeof(const char *);
 
 const char *SmartPrintNum(U u, FILE * fd = stdout)
 {
   static char buf[99];
   C x = (C) u;
-  if (link_map.find(u) != link_map.end()) {
-    sprintf(buf, "  L{%s}", link_map[x].c_str());
-  } else if (cfa_map.find(u) != cfa_map.end()) {
-    sprintf(buf, "  U{%s}", cfa_map[x].c_str());
-  } else if (dfa_map.find(u) != dfa_map.end()) {
-    sprintf(buf, "  D{%s}", dfa_map[x].c_str());
+  const IndexEntry *e = FindWord(u);
+  if (e && u == e->link) {
+    sprintf(buf, "  L{%s}", e->Name());
+  } else if (e && u == e->cfa) {
+    sprintf(buf, "  U{%s}", e->Name());
+  } else if (e && u == e->cfa + S) {
+    sprintf(buf, "  D{%s}", e->Name());
   } else if (-2 * MemLen <= x && x <= 2 * MemLen) {
     sprintf(buf, "  %llx", (ULL) u);
   } else {
     sprintf(buf, "  ---");
   }
   if (fd)
-    LOG(fd, "%s", buf);
+    FPF(fd, "%s", buf);         // Dumps print even without -t.
   return buf;
 };
 
@@ -123,11 +270,108 @@ void DumpMem(bool force = false)
   fflush(stdout);
 }
 
+// Trace files hold a TraceHeader, nsyms TraceSyms, then nrecs records
+// oldest first.  They are only readable by a build with the same CELLSIZE.
+struct TraceHeader {
+  char magic[4];
+  uint32_t cellsize;
+  uint32_t nsyms;
+  uint32_t nrecs;
+  ULL count;                    // total dispatches recorded
+  U here;                       // end of the dictionary
+};
+
+struct TraceSym {
+  U cfa;
+  char name[LEN_MASK + 1];
+};
+
+void TraceRing::Dump(const char *filename)
+{
+  FILE *fd = fopen(filename, "w");
+  if (!fd) {
+    FPF(stderr, " *** cannot write trace file `%s`\n", filename);
+    return;
+  }
+  UpdateIndex();
+  vector < TraceSym > syms;
+  for (const IndexEntry & e:word_index) {
+    TraceSym sym = { };
+    sym.cfa = e.cfa;
+    strncpy(sym.name, e.Name(), LEN_MASK);
+    syms.push_back(sym);
+  }
+  U n = (count_ < TRACELEN) ? count_ : TRACELEN;
+  TraceHeader h = { {'F', 'Y', 'T', 'R'}, (uint32_t) S, (uint32_t) syms.size(), (uint32_t) n, count_, Get(HerePtr) };
+  fwrite(&h, sizeof h, 1, fd);
+  fwrite(syms.data(), sizeof(TraceSym), syms.size(), fd);
+  for (ULL i = count_ - n; i < count_; i++) {
+    fwrite(&recs_[i & (TRACELEN - 1)], sizeof(Rec), 1, fd);
+  }
+  fclose(fd);
+}
+
+void TraceRing::Decode(const char *filename)
+{
+  // The VM was never initialized, so fail without Fatal's memory dump.
+  auto fail =[filename](const char *msg) {
+    FPF(stderr, " *** %s: %s: %s\n", Argv0, filename, msg);
+    exit(1);
+  };
+  FILE *fd = fopen(filename, "r");
+  if (!fd) {
+    fail("cannot open trace file");
+  }
+  TraceHeader h;
+  if (fread(&h, sizeof h, 1, fd) != 1 || memcmp(h.magic, "FYTR", 4) != 0) {
+    fail("not a trace file");
+  }
+  if (h.cellsize != S) {
+    FPF(stderr, " *** %s: %s: trace file has CELLSIZE %d, not %d\n", Argv0, filename, (int) h.cellsize, (int) S);
+    exit(1);
+  }
+  vector < TraceSym > syms(h.nsyms);
+  if (fread(syms.data(), sizeof(TraceSym), h.nsyms, fd) != h.nsyms) {
+    fail("short trace file");
+  }
+  std::sort(syms.begin(), syms.end(),[](const TraceSym & a, const TraceSym & b) {
+            return a.cfa < b.cfa;
+            });
+  // Name the word whose code contains addr:  the last cfa at or below it.
+  auto containing =[&syms, &h](U addr) -> const char * {
+    if (addr >= h.here)
+      return "?";
+    auto it = std::upper_bound(syms.begin(), syms.end(), addr,[](U a, const TraceSym & sym) {
+                               return a < sym.cfa;
+                               });
+    return (it == syms.begin())? "?" : (it - 1)->name;
+  };
+
+  printf("# %s: %u of %llu dispatches\n", filename, h.nrecs, h.count);
+  Rec r;
+  for (ULL i = h.count - h.nrecs; fread(&r, sizeof r, 1, fd) == 1; i++) {
+    const char *opname = (r.op < NumOpcodes) ? opcode_enum_names[r.op] : "?";
+    printf("%llu Ip=%llx in %s -> %s(%s) [%u; %u]\n", i, (ULL) r.ip, containing(r.ip), containing(r.cfa), opname,
+           r.rs, r.ds);
+  }
+  fclose(fd);
+}
+
+// DumpTrace writes the trace ring, if anything was traced.
+void DumpTrace()
+{
+  if (trace_ring.Empty())
+    return;
+  trace_ring.Dump(TraceFilename);
+  FPF(stderr, " *** %s: trace written to %s; decode with `%s -T%s`\n", Argv0, TraceFilename, Argv0, TraceFilename);
+}
+
 void CheckEq(int line, U a, U b)
 {
   if (a != b) {
     FPF(stderr, "*** CheckEq Fails: line %d: %llx != %llx\n", line, (ULL) a, (ULL) b);
     DumpMem(true);
+    DumpTrace();
     assert(0);
   }
 }
@@ -137,6 +381,7 @@ U CheckU(U x)
   if (!x) {
     FPF(stderr, "*** CheckU Fails\n");
     DumpMem(true);
+    DumpTrace();
     assert(x);
   }
   return x;
@@ -150,6 +395,8 @@ void Fatal(const char *msg)
   FPF(stderr, " *** %s: Fatal: %s\n", Argv0, msg);
   if (Fatality < 2)
     DumpMem(true);
+  if (Fatality < 2)
+    DumpTrace();
   assert(0);
 }
 
@@ -159,6 +406,8 @@ void FatalU(const char *msg, int x)
   FPF(stderr, " *** %s: FatalU: %s [0x%llx]\n", Argv0, msg, (ULL) x);
   if (Fatality < 2)
     DumpMem(true);
+  if (Fatality < 2)
+    DumpTrace();
   assert(0);
 }
 
@@ -168,6 +417,8 @@ void FatalI(const char *msg, int x)
   FPF(stderr, " *** %s: FatalI: %s [%d]\n", Argv0, msg, x);
   if (Fatality < 2)
     DumpMem(true);
+  if (Fatality < 2)
+    DumpTrace();
   assert(0);
 }
 
@@ -178,6 +429,8 @@ void FatalS(const char *msg, const char *s)
     FPF(stderr, " *** %s: FatalS: %s `%s`\n", Argv0, msg, s);
   if (Fatality < 2)
     DumpMem(true);
+  if (Fatality < 2)
+    DumpTrace();
   assert(0);
 }
 
@@ -294,10 +547,9 @@ void Key()
   Push(input_key.Key());
 }
 
-U PopNewKeyCheckEOF()
+U NewKeyCheckEOF()
 {
-  Key();
-  U c = Pop();
+  U c = input_key.Key();
   if (c & 256) {                // If EOF
     FPF(stderr, "<<<<< Exiting on EOF >>>>>\n");
     exit(0);
@@ -306,11 +558,13 @@ U PopNewKeyCheckEOF()
   return c;
 }
 
-void Word()
+// ReadWord reads the next word into Mem[1...], with its count at Mem[0],
+// and returns its length.
+int ReadWord()
 {
-  U c = PopNewKeyCheckEOF();
+  U c = NewKeyCheckEOF();
   while (c <= 32) {             // Skip white space (control chars are white space).
-    c = PopNewKeyCheckEOF();
+    c = NewKeyCheckEOF();
   }
   int i = 0;
   while (c > 32) {
@@ -319,22 +573,71 @@ void Word()
     }
     i++;
     Mem[i] = c;                 // Word starts at Mem[1]
-    c = PopNewKeyCheckEOF();
+    c = NewKeyCheckEOF();
   }
   Mem[i + 1] = 0;               // null-terminate the word.
   Mem[0] = i;                   // Save count at Mem[0]
+  WordDelimiter = c;
+  ++stats.words_read;
+  D(stderr, "<<<Word: %s>>>\n", Mem + 1);
+  return i;
+}
+
+void Word()
+{
+  int i = ReadWord();
   Push(1);                      // Pointer to word chars.
   Push(i);                      // Length.
-  D(stderr, "<<<Word: %s>>>\n", Mem + 1);
 }
 
 char *WordStr()
 {
-  Word();
-  Pop();                        // pop length
-  U wordIndex = Pop();          // pop word; should be 1.
-  LOG(stderr, " >>%s<< ", &Mem[wordIndex]);
-  return &Mem[wordIndex];
+  ReadWord();
+  LOG(stderr, " >>%s<< ", &Mem[1]);
+  return &Mem[1];
+}
+
+// NewToken assigns the next token to a new cfa.
+// Words are created at increasing addresses, so TokenCfa stays sorted.
+void NewToken(U cfa)
+{
+#if TOKENS
+  if (NumTokens >= MAXTOKENS) {
+    FatalI("Too many tokens", NumTokens);
+  }
+  TokenCfa[NumTokens] = cfa;
+#endif
+  ++NumTokens;
+}
+
+T TokenOfCfa(U cfa)
+{
+#if TOKENS
+  int lo = 0, hi = NumTokens;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (TokenCfa[mid] < cfa) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == NumTokens || TokenCfa[lo] != cfa) {
+    FatalU("TokenOfCfa: not a cfa", cfa);
+  }
+  return (T) lo;
+#else
+  return cfa;
+#endif
+}
+
+// CheckRoom fails if n bytes at here would run into the data stack,
+// which grows down toward the dictionary.
+void CheckRoom(U here, U n)
+{
+  if (here + n > Ds || here + n < here) {
+    FatalU("Dictionary full", here);
+  }
 }
 
 void CreateWord(const char *name, Opcode code, B flags = 0)
@@ -343,12 +646,12 @@ void CreateWord(const char *name, Opcode code, B flags = 0)
     FatalS("Creating word with name too long: `%s`", name);
   }
   U latest = Get(LatestPtr);
-  U here = Get(HerePtr);
+  U here = Aligned(Get(HerePtr));       // Allot may leave HERE unaligned.
   LOG(stderr,
       "CreateWord(%s, %llx): HerePtr=%llx HERE=%llx  latest=%llx\n",
       name, (ULL) code, (ULL) HerePtr, (ULL) here, (ULL) latest);
+  CheckRoom(here, Aligned(S + 1 + strlen(name) + 1) + S);
   Put(LatestPtr, here);
-  link_map[here] = name;
 
   Put(here, latest);
   here += S;
@@ -362,22 +665,141 @@ void CreateWord(const char *name, Opcode code, B flags = 0)
   }
 
   Put(here, code);
+  NewToken(here);
   here += S;
   Put(HerePtr, here);
+}
 
-  cfa_map[there] = name;
-  dfa_map[here] = name;
+// AlignHere pads HERE to a cell boundary, after threaded code.
+void AlignHere()
+{
+  U here = Get(HerePtr);
+  U there = Aligned(here);
+  CheckRoom(here, there - here);
+  while (here < there) {
+    Mem[here++] = 0xEE;         // 0xEE for debugging.
+  }
+  Put(HerePtr, here);
 }
 
 void Comma(U x)
 {
   U here = Get(HerePtr);
-  SmartPrintNum(x, stderr);
-  LOG(stderr, " Comma(%llx): HerePtr=%llx HERE=%llx\n", (ULL) x, (ULL) HerePtr, (ULL) here);
+  LOG(stderr, "%s Comma(%llx): HerePtr=%llx HERE=%llx\n", SmartPrintNum(x, nullptr), (ULL) x, (ULL) HerePtr,
+      (ULL) here);
+  CheckRoom(here, S);
   Put(here, x);
   Put(HerePtr, here + S);
 }
 
+// MapFile maps a host file read-only and pushes ( addr len ).
+void MapFile(const char *filename)
+{
+  if (NumMappings >= MaxMappings) {
+    FatalI("map-file: too many mappings", NumMappings);
+  }
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    FatalS("map-file: cannot open", filename);
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    FatalS("map-file: cannot stat", filename);
+  }
+  U len = (U) st.st_size;
+  if ((off_t) len != st.st_size) {
+    FatalS("map-file: file too big for CELLSIZE", filename);
+  }
+  if (len == 0) {
+    close(fd);
+    Push(0);
+    Push(0);
+    return;
+  }
+  // Small cells can only reach 4 GiB above Mem, so ask for a spot there.
+  void *hint = nullptr;
+  if (S < 8) {
+    U used = 0;
+    for (int k = 0; k < NumMappings; k++) {
+      used = std::max(used, Aligned(Mappings[k].addr + Mappings[k].len));
+    }
+    hint = Mem + std::max(used, (U) (1 << 30));
+  }
+  char *p = (char *) mmap(hint, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    FatalS("map-file: cannot mmap", filename);
+  }
+  U addr = (U) (p - Mem);
+  if (Mem + addr != p || (U) (addr + len) < addr) {     // wraps past 2^32?
+    munmap(p, len);
+    FatalS("map-file: mapping out of reach; use CELLSIZE 8", filename);
+  }
+  Mappings[NumMappings++] = {addr, len};
+  Push(addr);
+  Push(len);
+}
+
+void Unmap(U addr, U len)
+{
+  if (len == 0)
+    return;
+  for (int k = 0; k < NumMappings; k++) {
+    if (Mappings[k].addr == addr && Mappings[k].len == len) {
+      munmap(Mem + addr, len);
+      Mappings[k] = Mappings[--NumMappings];
+      return;
+    }
+  }
+  FatalU("unmap: not a mapping", addr);
+}
+
+U Allot(int n)
+{
+  U z = Get(HerePtr);
+  if (n > 0)
+    CheckRoom(z, n);
+  Put(HerePtr, z + n);
+  LOG(stderr, "Allot(%llx) : Here %llx -> Here %llx\n", (ULL) n, (ULL) z, (ULL) Get(HerePtr));
+  return z;
+}
+
+void CommaT(T x)
+{
+  U here = Get(HerePtr);
+  CheckRoom(here, TS);
+  PutT(here, x);
+  Put(HerePtr, here + TS);
+}
+
+// CommaCfa compiles a reference to the word at cfa.
+void CommaCfa(U cfa)
+{
+  LOG(stderr, "%s CommaCfa(%llx): HERE=%llx\n", SmartPrintNum(cfa, nullptr), (ULL) cfa, (ULL) Get(HerePtr));
+  CommaT(TokenOfCfa(cfa));
+}
+
+void CheckOffset(C x)
+{
+  if ((C) (ST) x != x) {
+    FatalI("Branch offset too big", (int) x);
+  }
+}
+
+// CommaOffset compiles an inline branch offset.
+void CommaOffset(C x)
+{
+  CheckOffset(x);
+  CommaT((T) x);
+}
+
+// PutOffset repairs an inline branch offset at i.
+void PutOffset(U i, C x)
+{
+  CheckOffset(x);
+  PutT(i, (T) x);
+}
+
 bool WordStrAsNumber(const char *s, U * out)
 {
   U z = 0;
@@ -402,64 +824,330 @@ bool WordStrAsNumber(const char *s, U * out)
 
 void Words()
 {
-  U ptr = Get(LatestPtr);
-  while (ptr) {
+  for (U ptr = Get(LatestPtr); ptr; ptr = Get(ptr)) {
     B flags = Mem[ptr + S];
     if (flags & HIDDEN_BIT)
       continue;
     char *name = &Mem[ptr + S + 1];     // name follows link and lenth/flags byte.
     printf(" %s", name);
-    ptr = Get(ptr);
   }
 }
 
-U LookupCfa(const char *s, B * flags_out = nullptr)
+// LookupCfaSlowly searches the dictionary chain, skipping hidden words.
+U LookupCfaSlowly(const char *s, B * flags_out)
 {
-  U ptr = Get(LatestPtr);
-  while (ptr) {
+  for (U ptr = Get(LatestPtr); ptr; ptr = Get(ptr)) {
     B flags = Mem[ptr + S];
     if (flags & HIDDEN_BIT)
       continue;
     char *name = &Mem[ptr + S + 1];     // name follows link and lenth/flags byte.
+    ++stats.probes;
     D(stderr, "LookupCfa(%s) trying ptr=%llx name=<%s>", s, (ULL) ptr, name);
     if (strcaseeq(s, name)) {
-      // code addr follows name and '\0' and alignment.
       if (flags_out)
         *flags_out = flags;
-      return Aligned(ptr + S + 1 + strlen(name) + 1);
+      return CfaOfLink(ptr);
     }
-    ptr = Get(ptr);
   }
   return 0;
 }
 
+U LookupCfa(const char *s, B * flags_out = nullptr)
+{
+  UpdateIndex();
+  ++stats.lookups;
+  if (name_hash.empty())
+    return 0;
+  size_t mask = name_hash.size() - 1;
+  for (size_t k = NameHash(s) & mask; name_hash[k]; k = (k + 1) & mask) {
+    U ptr = name_hash[k];
+    ++stats.probes;
+    if (strcaseeq(s, &Mem[ptr + S + 1])) {
+      B flags = Mem[ptr + S];
+      if (flags & HIDDEN_BIT)
+        return LookupCfaSlowly(s, flags_out);   // An older word may show.
+      if (flags_out)
+        *flags_out = flags;
+      return CfaOfLink(ptr);
+    }
+  }
+  return 0;
+}
+
+// CommaLiteral compiles code to push x, as a short `(slit)`
+// when x fits in a token, as `(ilit)` when it fits in 32 bits
+// and cells are bigger, else as `lit` with a full cell.
+void CommaLiteral(U x)
+{
+  if (TS < S && (C) (ST) x == (C) x) {
+    CommaCfa(CheckU(LookupCfa("(slit)")));
+    CommaT((T) x);
+  } else if (TS < 4 && 4 < S && (C) (int32_t) x == (C) x) {
+    CommaCfa(CheckU(LookupCfa("(ilit)")));
+    U here = Get(HerePtr);
+    CheckRoom(here, 4);
+    PutLit32(here, (int32_t) x);
+    Put(HerePtr, here + 4);
+  } else {
+    CommaCfa(CheckU(LookupCfa("lit")));
+    U here = Get(HerePtr);
+    CheckRoom(here, S);
+    PutLit(here, x);
+    Put(HerePtr, here + S);
+  }
+}
+
+// Class Seer decompiles a colon definition for `see`, using the nop
+// markers that IF, ELSE and THEN compile, and the DO loop primitives.
+class Seer {
+public:
+  void See(const char *name);
+private:
+  void Emit(const char *s);
+  void EmitNum(C x);
+  void Newline();
+  void Open(const char *s);     // word that begins a nested block
+  void Middle(const char *s);   // ELSE
+  void Close(const char *s);    // word that ends a nested block
+
+  int depth_;
+  bool fresh_;                  // nothing printed yet on this line
+};
+
+void Seer::Emit(const char *s)
+{
+  if (fresh_) {
+    printf("%*s", 2 * depth_, "");
+    fresh_ = false;
+  } else {
+    putchar(' ');
+  }
+  fputs(s, stdout);
+}
+
+void Seer::EmitNum(C x)
+{
+  char buf[24];
+  sprintf(buf, "%lld", (long long) x);
+  Emit(buf);
+}
+
+void Seer::Newline()
+{
+  if (!fresh_)
+    putchar('\n');
+  fresh_ = true;
+}
+
+void Seer::Open(const char *s)
+{
+  Emit(s);
+  Newline();
+  ++depth_;
+}
+
+void Seer::Middle(const char *s)
+{
+  Newline();
+  --depth_;
+  Emit(s);
+  Newline();
+  ++depth_;
+}
+
+void Seer::Close(const char *s)
+{
+  Newline();
+  --depth_;
+  Emit(s);
+  Newline();
+}
+
+void Seer::See(const char *name)
+{
+  U cfa = LookupCfa(name);
+  if (!cfa) {
+    FatalS("see: no such word", name);
+  }
+  const IndexEntry *e = FindWord(cfa);
+  U op = Get(cfa);
+  switch (op) {
+  case OP_X_ENTER_:
+    break;
+  case OP_XDOCON:
+    printf("%lld constant %s\n", (long long) (C) Get(cfa + S), e->Name());
+    return;
+  case OP_XDOVALUE:
+    printf("%lld value %s\n", (long long) (C) Get(cfa + S), e->Name());
+    return;
+  case OP_XDOVAR:
+    printf("variable %s\n", e->Name());
+    return;
+  case OP_XDODOES:{
+      U does = Get(cfa + S);
+      const IndexEntry *d = does ? FindWord(does) : nullptr;
+      printf("create %s", e->Name());
+      if (d)
+        printf("  ( does> in %s )", d->Name());
+      putchar('\n');
+    }
+    return;
+  default:
+    printf("%s is primitive opcode %llu\n", e->Name(), (ULL) op);
+    return;
+  }
+  depth_ = 1;
+  fresh_ = true;
+  printf(": %s\n", e->Name());
+
+  U end = EndOfWord(e);
+  U pos = cfa + S;
+  while (pos + TS <= end) {
+    U w = CfaOfToken(GetT(pos));
+    pos += TS;
+    switch (Get(w)) {
+    case OP_LIT:
+      EmitNum((C) GetLit(pos));
+      pos += S;
+      break;
+    case OP_X_SLIT_:
+      EmitNum(GetOffset(pos));
+      pos += TS;
+      break;
+    case OP_X_ILIT_:
+      EmitNum(GetLit32(pos));
+      pos += 4;
+      break;
+    case OP_XNOP_IF:          // nop_if 0branch offset
+      pos += 2 * TS;
+      Open("IF");
+      break;
+    case OP_XNOP_ELSE:        // nop_else branch offset nop
+      pos += 3 * TS;
+      Middle("ELSE");
+      break;
+    case OP_XNOP_THEN:
+      Close("THEN");
+      break;
+    case OP_X_DO_:            // (do) offset
+      pos += TS;
+      Open("DO");
+      break;
+    case OP_X_HUH_DO_:
+      pos += TS;
+      Open("?DO");
+      break;
+    case OP_X_LOOP_:          // (loop) offset
+      pos += TS;
+      Close("LOOP");
+      break;
+    case OP_X_PLUS_LOOP_:
+      pos += TS;
+      Close("+LOOP");
+      break;
+    case OP_X_LEAVE_:
+      Emit("LEAVE");
+      break;
+    case OP_X_DOES_:          // the rest is the DOES> code.
+      Newline();
+      --depth_;
+      Emit("DOES>");
+      Newline();
+      ++depth_;
+      break;
+    case OP_XBRANCH:
+    case OP_XBRANCH0:{
+        char buf[40];
+        sprintf(buf, "%s[%+lld]", FindWord(w)->Name(), (long long) GetOffset(pos));
+        Emit(buf);
+        pos += TS;
+      }
+      break;
+    case OP_X_EXIT_:
+      if (Aligned(pos) >= end) {        // only `;` padding follows.
+        Newline();
+        printf(";\n");
+        return;
+      }
+      Emit("EXIT");
+      break;
+    default:
+      Emit(FindWord(w)->Name());
+    }
+  }
+  Newline();
+  printf("( no exit )\n");
+}
+
+ULL NowNanos()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ULL) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+ULL NowMicros()
+{
+  return NowNanos() / 1000;
+}
+
+// RefillBudget hands DispatchLoop its next batch of ticks.  With a time
+// budget, batches are small enough that the clock is read often.
+int64_t RefillBudget()
+{
+  int64_t batch = budget_ticks_left;
+  if (budget_deadline && batch > BudgetPoll)
+    batch = BudgetPoll;
+  budget_ticks_left -= batch;
+  return batch;
+}
+
+int64_t StartBudget()
+{
+  budget_ticks_left = BudgetTicks ? (int64_t) BudgetTicks : INT64_MAX;
+  budget_deadline = BudgetMicros ? NowMicros() + BudgetMicros : 0;
+  return RefillBudget();
+}
+
+// BudgetSpent is called when DispatchLoop has used up its batch of ticks.
+// It either refills the batch, or decides the evaluation must stop.
+bool BudgetSpent(int64_t &budget)
+{
+  if ((budget_deadline && NowMicros() >= budget_deadline) || budget_ticks_left <= 0) {
+    BudgetBlown = true;
+    return true;
+  }
+  budget = RefillBudget() - 1;  // less the tick being spent now.
+  return false;
+}
+
 #ifdef OPT
 
-#define DISPATCH cfa = Get(Ip); Ip += S; op = Get(cfa); W = cfa + S; goto *dispatch_table[op];
+#define DISPATCH cfa = CfaOfToken(GetT(Ip)); Ip += TS; op = Get(cfa); W = cfa + S; goto *dispatch_table[op];
 
 #else
 
 #define DISPATCH {\
     ShowDispatch();\
-    cfa = Get(Ip);\
-    Ip += S;\
+    cfa = CfaOfToken(GetT(Ip));\
+    Ip += TS;\
     op = Get(cfa);\
     W = cfa + S;\
     goto *dispatch_table[op];\
     }
 
-const char *opcode_enum_names[] = {
-#include "generated-enum-names.inc"
-};
-
 void ShowDispatch()
 {
-  U cfa = Get(Ip);
+  U cfa = CfaOfToken(GetT(Ip));
   U op = Get(cfa);
+  trace_ring.Record(cfa, op);
+  if (!TraceText)
+    return;
+
   U return_size = Rs0 - Rs;
   U data_size = Ds0 - Ds;
   const char *opname = "?opcode-out-of-range?";
-  if (0 <= op && op < sizeof(opcode_enum_names) / sizeof(const char *)) {
+  if (0 <= op && op < NumOpcodes) {
     opname = opcode_enum_names[op];
   }
   LOG(stderr, " Ip=%lld -> %lld(%s) -> %lld(%s)  [%llu; %llu]", (ULL) Ip, (ULL) cfa, SmartPrintNum(cfa, nullptr),
@@ -471,7 +1159,20 @@ void ShowDispatch()
 }
 #endif
 
-void DispatchLoop()
+// BUDGET_TICK spends a tick of the execution budget.  When the budget
+// is spent, it abandons the evaluation by running StopThread.
+#define BUDGET_TICK if (--budget < 0 && BudgetSpent(budget)) { Ip = StopThread; DISPATCH; }
+
+// DispatchLoop keeps the innermost DO loop in locals.  LOOP_SAVE pushes
+// the outer loop's frame on the return stack:  its leave address, limit,
+// then index, so `j` finds the index at Rs and `k` at Rs + 3 * S.
+// LOOP_RESTORE pops the frame back into the locals.
+#define LOOP_SAVE { PushR(loop_leave); PushR((U) loop_limit); PushR((U) loop_i); }
+#define LOOP_RESTORE { loop_i = (C) PopR(); loop_limit = (C) PopR(); loop_leave = PopR(); }
+
+// DispatchLoop runs threaded code at Ip until `(stop)`.  If start is
+// a cfa, it first runs that word directly, as if it had been dispatched.
+void DispatchLoop(U start = 0)
 {
   static void *dispatch_table[] = {
 #include "generated-dispatch-table.inc"
@@ -479,26 +1180,73 @@ void DispatchLoop()
 
   U cfa;
   U op;
-
+  C loop_i = 0;                 // index of the innermost DO loop
+  C loop_limit = 0;             // limit of the innermost DO loop
+  U loop_leave = 0;             // where LEAVE goes in the innermost DO loop
+  int64_t budget = StartBudget();       // ticks left in this batch
+
+  if (start) {
+    cfa = start;
+    op = Get(cfa);
+    W = cfa + S;
+#ifndef OPT
+    trace_ring.Record(cfa, op);
+#endif
+    goto *dispatch_table[op];
+  }
   DISPATCH;
   while (true) {
 #include "generated-dispatchers.inc"
   }
 }
 
-void ExecuteCfa(U cfa)
+// ExecuteCfa returns false if the word ran out of execution budget.
+// Then the return stack is reset, but the data stack is left as it was.
+bool ExecuteCfa(U cfa)
 {
-  U stop = LookupCfa("(stop)");
-  PushR(stop);
-  PushR(cfa);
-  Ip = Rs;
+  // Jump straight into the word; when it is done it returns to
+  // StopThread, whose `(stop)` leaves the dispatch loop.
+  U rs = Rs;
+  Ip = StopThread;
+
+  if (stats.timing) {
+    ULL start = NowNanos();
+    stats.outer_ns += start - stats.mark_ns;
+    DispatchLoop(cfa);
+    stats.mark_ns = NowNanos();
+    stats.dispatch_ns += stats.mark_ns - start;
+  } else {
+    DispatchLoop(cfa);
+  }
 
-  DispatchLoop();
+  if (BudgetBlown) {
+    BudgetBlown = false;
+    Rs = rs;
+    return false;
+  }
+#ifndef OPT
+  CheckEq(__LINE__, Rs, rs);
+  CheckEq(__LINE__, Ip, StopThread + TS);
+#endif
+  return true;
+}
 
-  U r1 = PopR();
-  CheckEq(__LINE__, r1, cfa);
-  U r2 = PopR();
-  CheckEq(__LINE__, r2, stop);
+// OutOfBudget returns control to the outer interpreter after the word
+// ran out of execution budget.  Like ABORT, it empties the data stack,
+// drops any definition being compiled, and throws away the rest of the
+// input line.  Interpretation resumes with the next line.
+void OutOfBudget(const char *word)
+{
+  FPF(stderr, " *** %s: `%s` ran out of execution budget\n", Argv0, word);
+  Ds = Ds0;
+  if (Get(StatePtr)) {
+    Put(HerePtr, ColonHere);
+    Put(LatestPtr, ColonLatest);
+    NumTokens = ColonTokens;
+    Put(StatePtr, 0);
+  }
+  for (U c = WordDelimiter; c != '\n'; c = NewKeyCheckEOF()) {
+  }
 }
 
 void ExecuteWordStr(const char *s)
@@ -518,44 +1266,23 @@ void ExecuteWordStr(const char *s)
   }
   U op = Get(cfa);
   D(stderr, " ExecuteWordStr(%s)@%llx(op%llx) ", s, (ULL) cfa, (ULL) op);
-
-  PushR(0);
-  PushR(cfa);
-  Ip = Rs;
-  PushR(0);
-  U rs = Rs;
-
-  DispatchLoop();
-
-  CheckEq(__LINE__, rs, Rs);
-  CheckEq(__LINE__, Ip, rs + 2 * S);
-  U r0 = PopR();
-  CheckEq(__LINE__, r0, 0);
-  U r1 = PopR();
-  CheckEq(__LINE__, r1, cfa);
-  U r2 = PopR();
-  CheckEq(__LINE__, r2, 0);
-}
-
-U Allot(int n)
-{
-  U z = Get(HerePtr);
-  Put(HerePtr, z + n);
-  LOG(stderr, "Allot(%llx) : Here %llx -> Here %llx\n", (ULL) n, (ULL) z, (ULL) Get(HerePtr));
-  return z;
+  if (!ExecuteCfa(cfa))
+    OutOfBudget(s);
 }
 
 void Init()
 {
   // memset(Mem, 0, MemLen);
 
-  U ptr = LINELEN;
+  U ptr = Aligned(LINELEN);
   HerePtr = ptr;
   ptr += S;
   LatestPtr = ptr;
   ptr += S;
   StatePtr = ptr;
   ptr += S;
+  StopThread = ptr;
+  ptr += S;
   Put(HerePtr, ptr);
   Put(LatestPtr, 0);
   Put(StatePtr, 0);
@@ -566,6 +1293,15 @@ void Init()
   Put(Ds0, 0xEEEE);             // Debugging mark.
 
 #include "generated-creators.inc"
+
+  PutT(StopThread, TokenOfCfa(CheckU(LookupCfa("(stop)"))));
+
+  UpdateIndex();
+  stats.ds_low = Ds0;
+  stats.rs_low = Rs0;
+  stats.dict_start = StopThread + S;
+  stats.builtin_words = word_index.size();
+  stats.mark_ns = NowNanos();
 }
 
 void Interpret1()
@@ -579,20 +1315,21 @@ void Interpret1()
     // Found a word.
     if (compiling) {
       if (flags & IMMEDIATE_BIT) {
-        ExecuteCfa(cfa);
+        if (!ExecuteCfa(cfa))
+          OutOfBudget(word);
       } else {
-        Comma(cfa);
+        CommaCfa(cfa);
       }
     } else {
-      ExecuteCfa(cfa);
+      if (!ExecuteCfa(cfa))
+        OutOfBudget(word);
     }
   } else {
     // Word not found -- is it a literal?
     U x;
     if (WordStrAsNumber(word, &x)) {
       if (compiling) {
-        Comma(CheckU(LookupCfa("lit")));
-        Comma(x);
+        CommaLiteral(x);
       } else {
         Push(x);                // immediately: push x on stack.
       }
@@ -619,6 +1356,194 @@ void PrintIntSizes()
   printf("-42 => unsigned char %d\n", (int) (unsigned char) (-42));
 }
 
+void Stats::Print(FILE * fd)
+{
+  UpdateIndex();
+  U used = Get(HerePtr) - dict_start;
+  FPF(fd, "words defined:  %d (%d built in)\n", (int) word_index.size(), builtin_words);
+  FPF(fd, "dictionary:     %llu of %llu bytes (%.1f%%)\n", (ULL) used, (ULL) MemLen, 100.0 * used / MemLen);
+  FPF(fd, "data stack:     %llu cells at most\n", (ULL) (Ds0 - ds_low) / S);
+  FPF(fd, "return stack:   %llu of %llu cells at most\n", (ULL) (Rs0 - rs_low) / S, (ULL) (Rs0 - Ds0) / S);
+  FPF(fd, "lookups:        %llu, comparing %.2f names each\n", lookups, lookups ? (double) probes / lookups : 0.0);
+  FPF(fd, "words read:     %llu\n", words_read);
+  if (!timing) {
+    FPF(fd, "times:          not measured without -M\n");
+    return;
+  }
+  FPF(fd, "outer time:     %.3f ms reading and compiling\n", outer_ns / 1e6);
+  FPF(fd, "dispatch time:  %.3f ms in DispatchLoop\n", dispatch_ns / 1e6);
+}
+
+void Stats::AtExit()
+{
+  ULL now = NowNanos();
+  stats.outer_ns += now - stats.mark_ns;
+  stats.mark_ns = now;
+  stats.Print(stderr);
+}
+
+void Profiler::Start(int hz, const char *filename)
+{
+  if (hz <= 0) {
+    FatalI("profiler: bad rate", hz);
+  }
+  filename_ = filename;
+  cells_ = new U[MaxCells];
+  used_ = 0;
+  dropped_ = 0;
+
+  struct sigaction sa = { };
+  sa.sa_handler = OnSignal;
+  sa.sa_flags = SA_RESTART;     // Do not disturb reading input.
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGPROF, &sa, nullptr) < 0) {
+    FPF(stderr, " *** %s: profiler: sigaction: %s\n", Argv0, strerror(errno));
+    exit(1);
+  }
+
+  long usec = (hz >= 1000000) ? 1 : 1000000 / hz;
+  struct itimerval it = { };
+  it.it_interval.tv_sec = usec / 1000000;
+  it.it_interval.tv_usec = usec % 1000000;
+  it.it_value = it.it_interval;
+  if (setitimer(ITIMER_PROF, &it, nullptr) < 0) {
+    FPF(stderr, " *** %s: profiler: setitimer: %s\n", Argv0, strerror(errno));
+    exit(1);
+  }
+  atexit(AtExit);               // Only now is there a profile to write.
+}
+
+void Profiler::OnSignal(int sig)
+{
+  profiler.Sample();
+}
+
+void Profiler::Sample()
+{
+  // Runs in the signal handler:  copy raw cells, without checks or calls.
+  U rs = Rs;
+  int n = (rs < Rs0) ? (Rs0 - rs) / S : 0;
+  if (n > MaxDepth)
+    n = MaxDepth;
+  if (used_ + 3 + n > MaxCells) {
+    ++dropped_;
+    return;
+  }
+  cells_[used_] = n;
+  cells_[used_ + 1] = Ip;
+  cells_[used_ + 2] = W;
+  memcpy(&cells_[used_ + 3], Mem + rs, n * S);
+  used_ += 3 + n;
+}
+
+void Profiler::AtExit()
+{
+  struct itimerval it = { };
+  setitimer(ITIMER_PROF, &it, nullptr);
+  profiler.Write();
+}
+
+// IsReturnAddress is true if a follows a call of a colon or DOES> word.
+// That rejects DO loop frames and most data put on the return stack.
+bool Profiler::IsReturnAddress(U a)
+{
+  if (word_index.empty() || a < word_index.front().cfa + S || a >= Get(HerePtr) || (a & (TS - 1)))
+    return false;
+  const char *name = TokenName(a - TS);
+  if (!name)
+    return false;
+  U op = Get(CfaOfToken(GetT(a - TS)));
+  return op == OP_X_ENTER_ || op == OP_XDODOES;
+}
+
+// TokenName names the word whose token is at a, or returns nullptr.
+const char *Profiler::TokenName(U a)
+{
+  if (a >= Get(HerePtr) || (a & (TS - 1)))
+    return nullptr;
+  T t = GetT(a);
+#if TOKENS
+  if (t >= NumTokens)
+    return nullptr;
+#endif
+  return CfaName(CfaOfToken(t));
+}
+
+// CfaName names the word whose cfa is cfa, or returns nullptr.
+const char *Profiler::CfaName(U cfa)
+{
+  const IndexEntry *e = FindWord(cfa);
+  if (!e || e->cfa != cfa)
+    return nullptr;
+  return e->Name();
+}
+
+void Profiler::Write()
+{
+  UpdateIndex();
+  vector < string > stacks;
+  for (int k = 0; k < used_;) {
+    int n = cells_[k];
+    U ip = cells_[k + 1];
+    U w = cells_[k + 2];
+    U *r = &cells_[k + 3];
+    k += 3 + n;
+    // W - S is the cfa of the word being executed.  Ip is no help there:
+    // it may have just branched, and non-OPT builds sample in ShowDispatch,
+    // before Ip moves past the next token.
+    const char *leaf = CfaName(w - S);
+
+    string stack;
+    for (int j = n - 1; j >= 0; j--) {  // outermost caller first.
+      if (IsReturnAddress(r[j])) {
+        stack += FindWord(r[j])->Name();
+        stack += ';';
+      }
+    }
+    if (ip == StopThread + TS) {
+      stack += "(outer)";       // reading or compiling, not executing.
+    } else if (ip == StopThread) {
+      stack += leaf ? leaf : "(top)";   // a primitive called from the outer interpreter.
+    } else if (const IndexEntry * e = FindWord(ip)) {
+      stack += e->Name();
+      if (leaf && w - S != e->cfa) {    // not just entered e.
+        stack += ';';
+        stack += leaf;
+      }
+    } else {
+      stack += "?";
+    }
+    stacks.push_back(stack);
+  }
+  std::sort(stacks.begin(), stacks.end());
+
+  FILE *fd = fopen(filename_, "w");
+  if (!fd) {
+    FPF(stderr, " *** cannot write profile `%s`\n", filename_);
+    return;
+  }
+  for (size_t i = 0; i < stacks.size();) {
+    size_t j = i;
+    while (j < stacks.size() && stacks[j] == stacks[i])
+      j++;
+    fprintf(fd, "%s %llu\n", stacks[i].c_str(), (ULL) (j - i));
+    i = j;
+  }
+  fclose(fd);
+  FPF(stderr, " *** %s: %llu samples written to %s", Argv0, (ULL) stacks.size(), filename_);
+  if (dropped_)
+    FPF(stderr, " (%d dropped)", dropped_);
+  FPF(stderr, "\n");
+}
+
+// BadFlag reports a bad command line flag.  Memory is not set up yet,
+// so there is nothing for Fatal to dump.
+void BadFlag(const char *flag)
+{
+  FPF(stderr, " *** %s: bad flag `%s`\n", Argv0, flag);
+  exit(2);
+}
+
 void Main(int argc, const char *argv[])
 {
   // MemLen = 0x10000;             // Default: 64 kib RAM.
@@ -627,6 +1552,8 @@ void Main(int argc, const char *argv[])
   ++argv, --argc;
   const char *text = "";
   bool interactive = false;
+  int profile_hz = 0;
+  const char *profile_filename = "fy.folded";
   while (argc > 0 && argv[0][0] == '-') {
     switch (argv[0][1]) {
     case 'd':
@@ -641,8 +1568,48 @@ void Main(int argc, const char *argv[])
     case 'c':
       text = &argv[0][2];
       break;
+    case 't':
+      TraceText = true;
+      break;
+    case 'b':
+      TraceFilename = &argv[0][2];
+      break;
+    case 'T':
+      TraceRing::Decode(&argv[0][2]);
+      exit(0);
+    case 'P':{
+        char *end;
+        long hz = strtol(&argv[0][2], &end, 10);
+        if (end == &argv[0][2] || *end || hz <= 0 || hz > 1000000) {
+          BadFlag(argv[0]);
+        }
+        profile_hz = (int) hz;
+      }
+      break;
+    case 'F':
+      profile_filename = &argv[0][2];
+      break;
+    case 'M':
+      stats.timing = true;
+      atexit(Stats::AtExit);
+      break;
+    case 'L':{
+        // -L<n> allows n ticks per evaluation; -L<n>ms allows n msec.
+        char *end;
+        ULL n = strtoull(&argv[0][2], &end, 10);
+        if (end == &argv[0][2]) {
+          BadFlag(argv[0]);
+        } else if (!strcmp(end, "ms")) {
+          BudgetMicros = n * 1000;
+        } else if (!*end) {
+          BudgetTicks = n;
+        } else {
+          BadFlag(argv[0]);
+        }
+      }
+      break;
     default:
-      FatalS("Bad flag", argv[0]);
+      BadFlag(argv[0]);
     }
     ++argv, --argc;
   }
@@ -652,6 +1619,9 @@ void Main(int argc, const char *argv[])
   }
   input_key.Init(text, argc, argv, interactive);
   Init();
+  if (profile_hz) {
+    profiler.Start(profile_hz, profile_filename);
+  }
   Interpret();
 }
 
@@ -14,7 +14,27 @@ extern int Debug;
 #endif
 
 #ifndef MEMLEN
-#define MEMLEN 0x1000
+#if CELLSIZE == 8
+#define MEMLEN 0x10000
+#else
+#define MEMLEN 0x4000
+#endif
+#endif
+
+// TOKENS selects token-threaded code:  compiled references are 16-bit
+// execution tokens mapped through TokenCfa[], and inline branch offsets
+// are 16 bits.  It defaults on for 64-bit cells, where it cuts code size
+// by four.
+#ifndef TOKENS
+#define TOKENS (CELLSIZE == 8)
+#endif
+
+#ifndef MAXTOKENS
+#define MAXTOKENS 0x2000
+#endif
+
+#ifndef TRACELEN
+#define TRACELEN 0x10000        // Must be a power of two.
 #endif
 
 #if CELLSIZE == 2
@@ -31,10 +51,21 @@ typedef double F;               // Floating point
 #else
 error-- unknown cellsize;
 #endif
+#if TOKENS
+#if CELLSIZE < 4
+error-- TOKENS needs CELLSIZE 4 or 8;
+#endif
+typedef uint16_t T;             // Token (compiled reference)
+typedef int16_t ST;             // Signed token-sized offset or literal
+#else
+typedef U T;                    // Without TOKENS, a token is just a cfa.
+typedef C ST;
+#endif
 typedef unsigned char B;        // Byte
 typedef unsigned long long ULL;
 
 constexpr size_t S = sizeof(C);
+constexpr size_t TS = sizeof(T);
 constexpr size_t LINELEN = 500;
 
 constexpr int MemLen = MEMLEN;
@@ -55,6 +86,8 @@ extern U Rs0;                   // return stack base
 extern U Ip;                    // instruction ptr
 extern U W;                     // W register
 extern const char *Argv0;
+extern U TokenCfa[];            // maps token to cfa, if TOKENS.
+extern int NumTokens;
 
 typedef enum {
 #include "generated-enum.inc"
@@ -76,6 +109,27 @@ extern void FatalU(const char *msg, int x);
 extern void FatalI(const char *msg, int x);
 extern void FatalS(const char *msg, const char *s);
 
+// Files mapped read-only by map-file live outside Mem, at the VM address
+// (host address - Mem), so Get reads them without copying.  Get and GetB
+// accept addresses in a mapping; Put and PutB do not.
+struct Mapping {
+  U addr;
+  U len;
+};
+constexpr int MaxMappings = 16;
+extern Mapping Mappings[MaxMappings];
+extern int NumMappings;
+
+inline bool IsMapped(U i, U n)
+{
+  for (int k = 0; k < NumMappings; k++) {
+    U off = i - Mappings[k].addr;
+    if (off < Mappings[k].len && n <= Mappings[k].len - off)
+      return true;
+  }
+  return false;
+}
+
   // Get & Put.
 
 inline U Get(U i)
@@ -84,7 +138,7 @@ inline U Get(U i)
   if ((i & (S - 1)) != 0) {
     FatalU("Get: bad alignment", i);
   }
-  if ((unsigned long long) i >= (unsigned long long) MemLen) {
+  if ((unsigned long long) i >= (unsigned long long) MemLen && !IsMapped(i, S)) {
     FatalU("Get: too big", i);
   }
 #endif
@@ -104,6 +158,142 @@ inline void Put(U i, U x)
   *(U *) (Mem + i) = x;
 };
 
+inline B GetB(U i)
+{
+#ifndef OPT
+  if ((unsigned long long) i >= (unsigned long long) MemLen && !IsMapped(i, 1)) {
+    FatalU("GetB: too big", i);
+  }
+#endif
+  return (B) Mem[i];
+};
+
+inline void PutB(U i, B x)
+{
+#ifndef OPT
+  if ((unsigned long long) i >= (unsigned long long) MemLen) {
+    FatalU("PutB: too big", i);
+  }
+#endif
+  Mem[i] = (char) x;
+};
+
+  // GetT & PutT fetch and store tokens and inline offsets in threaded code.
+
+inline T GetT(U i)
+{
+#ifndef OPT
+  if ((i & (TS - 1)) != 0) {
+    FatalU("GetT: bad alignment", i);
+  }
+  if ((unsigned long long) i >= (unsigned long long) MemLen) {
+    FatalU("GetT: too big", i);
+  }
+#endif
+  return *(T *) (Mem + i);
+};
+
+inline void PutT(U i, T x)
+{
+#ifndef OPT
+  if ((i & (TS - 1)) != 0) {
+    FatalU("PutT: bad alignment", i);
+  }
+  if ((unsigned long long) i >= (unsigned long long) MemLen) {
+    FatalU("PutT: too big", i);
+  }
+#endif
+  *(T *) (Mem + i) = x;
+};
+
+// GetOffset sign-extends an inline branch offset.
+inline C GetOffset(U i)
+{
+  return (C) (ST) GetT(i);
+}
+
+// GetLit fetches an inline full-cell literal, which is only
+// token-aligned in threaded code.
+inline U GetLit(U i)
+{
+#ifndef OPT
+  if ((unsigned long long) i + S > (unsigned long long) MemLen) {
+    FatalU("GetLit: too big", i);
+  }
+#endif
+  U x;
+  memcpy(&x, Mem + i, S);
+  return x;
+};
+
+inline void PutLit(U i, U x)
+{
+#ifndef OPT
+  if ((unsigned long long) i + S > (unsigned long long) MemLen) {
+    FatalU("PutLit: too big", i);
+  }
+#endif
+  memcpy(Mem + i, &x, S);
+};
+
+// GetLit32 & PutLit32 are for inline 32-bit literals, which
+// sign-extend to a full cell.
+inline C GetLit32(U i)
+{
+#ifndef OPT
+  if ((unsigned long long) i + 4 > (unsigned long long) MemLen) {
+    FatalU("GetLit32: too big", i);
+  }
+#endif
+  int32_t x;
+  memcpy(&x, Mem + i, 4);
+  return (C) x;
+};
+
+inline void PutLit32(U i, int32_t x)
+{
+#ifndef OPT
+  if ((unsigned long long) i + 4 > (unsigned long long) MemLen) {
+    FatalU("PutLit32: too big", i);
+  }
+#endif
+  memcpy(Mem + i, &x, 4);
+};
+
+inline U CfaOfToken(T t)
+{
+#if TOKENS
+#ifndef OPT
+  if (t >= NumTokens) {
+    FatalU("CfaOfToken: bad token", t);
+  }
+#endif
+  return TokenCfa[t];
+#else
+  return t;
+#endif
+};
+
+// Stats counts what the `stats` word and the -M flag report.  The stacks
+// grow down, so their high-water marks are their lowest pointers.
+struct Stats {
+  U ds_low;                     // lowest Ds, from Push.
+  U rs_low;                     // lowest Rs, from PushR.
+  U dict_start;                 // where the dictionary starts.
+  int builtin_words;            // words made by Init.
+  ULL lookups;                  // calls of LookupCfa.
+  ULL probes;                   // names compared by LookupCfa.
+  ULL words_read;               // words read from the input.
+  bool timing;                  // -M: measure the times below.
+  ULL dispatch_ns;              // time in DispatchLoop.
+  ULL outer_ns;                 // time outside it: reading and compiling.
+  ULL mark_ns;                  // when the current one of those began.
+
+  void Print(FILE * fd);
+  static void AtExit();
+};
+extern Stats stats;
+
   // Peek, Poke, Push, Pop.
 inline U Pop()
 {
@@ -122,6 +312,8 @@ inline C CPop()
 inline void Push(U x, int i = 0)
 {
   Ds -= S;
+  if (Ds < stats.ds_low)
+    stats.ds_low = Ds;
   Put(Ds, x);
 }
 
@@ -161,6 +353,8 @@ inline U PopR()
 inline void PushR(U x, int i = 0)
 {
   Rs -= S;
+  if (Rs < stats.rs_low)
+    stats.rs_low = Rs;
   Put(Rs, x);
 }
 
@@ -203,3 +397,60 @@ private:
   char *ln_next_;
 #endif
 };
+
+// Class TraceRing keeps the most recent TRACELEN dispatches in a binary
+// ring buffer.  Non-OPT builds Record every dispatch.  Dump writes the
+// ring and the dictionary names to a file; Decode renders such a file.
+class TraceRing {
+public:
+  void Record(U cfa, U op) {
+    Rec & r = recs_[count_++ & (TRACELEN - 1)];
+    r.ip = Ip;
+    r.cfa = cfa;
+    r.op = (uint16_t) op;
+    r.rs = (uint16_t) ((Rs0 - Rs) / S);
+    r.ds = (uint16_t) ((Ds0 - Ds) / S);
+  }
+  bool Empty() {
+    return count_ == 0;
+  }
+  void Dump(const char *filename);
+  static void Decode(const char *filename);
+private:
+  struct Rec {
+    U ip;
+    U cfa;
+    uint16_t op;
+    uint16_t rs;                // return stack depth in cells
+    uint16_t ds;                // data stack depth in cells
+  };
+  static_assert((TRACELEN & (TRACELEN - 1)) == 0, "TRACELEN must be a power of two");
+
+  Rec recs_[TRACELEN];
+  ULL count_;
+};
+
+// Class Profiler samples Ip and the return stack on SIGPROF.  The
+// signal handler only copies cells; at exit, the samples are named
+// through the dictionary and written as collapsed stacks, one line per
+// distinct stack, for flame graph tools.
+class Profiler {
+public:
+  void Start(int hz, const char *filename);
+private:
+  static void OnSignal(int sig);
+  static void AtExit();
+  void Sample();
+  void Write();
+  bool IsReturnAddress(U a);
+  const char *TokenName(U a);
+  const char *CfaName(U cfa);
+
+  static constexpr int MaxDepth = 128;  // cells of return stack per sample
+  static constexpr int MaxCells = 1 << 20;
+
+  const char *filename_;
+  U *cells_;                    // per sample: n, Ip, W, then n return stack cells.
+  int used_;
+  int dropped_;
+};